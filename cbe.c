@@ -1,12 +1,21 @@
+#ifdef __linux__
+// Needed for `copy_file_range`.
+#define _GNU_SOURCE
+#endif
+
 #include "cbe.h"
 #include "cbe_log.h"
 #include "cbe_register.h"
 #include "cbe_types.h"
 #include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 /* --------------- CONTEXT FUNCTIONS --------------- */
 
@@ -30,6 +39,11 @@ void cbe_context_init(struct cbe_context *context) {
 
 void cbe_context_free(struct cbe_context *context) {
   slice_free(&context->global_variables);
+  for (size_t i = 0; i < context->functions.size; i++) {
+    slice_free(&context->functions.items[i].instructions);
+    slice_free(&context->functions.items[i].labels);
+  }
+  slice_free(&context->functions);
   slice_free(&context->symbol_table);
   slice_free(&context->live_intervals);
   slice_free(&context->active_intervals);
@@ -79,6 +93,19 @@ void cbe_context_build_global_variable(struct cbe_context *context,
 void cbe_context_build_function(struct cbe_context *context, const char *name) {
   CBE_ASSERT(context->current_function_index == -1);
 
+  struct cbe_function_builder builder =
+      cbe_context_create_function_builder(context, name);
+  context->current_function_index = (int)builder.function_index;
+}
+
+void cbe_context_finish_current_function(struct cbe_context *context) {
+  CBE_ASSERT(context->current_function_index != -1);
+  context->current_function_index = -1;
+}
+
+struct cbe_function_builder
+cbe_context_create_function_builder(struct cbe_context *context,
+                                    const char *name) {
   struct cbe_function fn;
   fn.name = name;
   slice_init(&fn.instructions);
@@ -87,74 +114,61 @@ void cbe_context_build_function(struct cbe_context *context, const char *name) {
   // slice_init(&fn.locals);
 
   slice_push(&context->functions, fn);
-  context->current_function_index = context->functions.size - 1;
+  return (struct cbe_function_builder){context, context->functions.size - 1};
 }
 
-void cbe_context_finish_current_function(struct cbe_context *context) {
+static struct cbe_function_builder
+cbe_context_current_builder(struct cbe_context *context) {
   CBE_ASSERT(context->current_function_index != -1);
-  context->current_function_index = -1;
+  return (struct cbe_function_builder){
+      context, (size_t)context->current_function_index};
 }
 
-void cbe_context_build_inst_add(struct cbe_context *context,
-                                struct cbe_typed_value left,
-                                struct cbe_typed_value right) {
-  slice_push(
-      &context->functions.items[context->current_function_index].instructions,
-      (struct cbe_instruction){
-          .tag = CBE_INST_ADD, .interval_index = 0, .add = {left, right}});
+size_t cbe_context_build_inst_add(struct cbe_context *context,
+                                  struct cbe_typed_value left,
+                                  struct cbe_typed_value right) {
+  struct cbe_function_builder builder = cbe_context_current_builder(context);
+  return cbe_function_builder_push(&builder, cbe_build_inst_add(left, right));
 }
 
-void cbe_context_build_inst_sub(struct cbe_context *context,
-                                struct cbe_typed_value left,
-                                struct cbe_typed_value right) {
-  slice_push(
-      &context->functions.items[context->current_function_index].instructions,
-      (struct cbe_instruction){
-          .tag = CBE_INST_SUB, .interval_index = 0, .sub = {left, right}});
+size_t cbe_context_build_inst_sub(struct cbe_context *context,
+                                  struct cbe_typed_value left,
+                                  struct cbe_typed_value right) {
+  struct cbe_function_builder builder = cbe_context_current_builder(context);
+  return cbe_function_builder_push(&builder, cbe_build_inst_sub(left, right));
 }
 
-void cbe_context_build_inst_mul(struct cbe_context *context,
-                                struct cbe_typed_value left,
-                                struct cbe_typed_value right) {
-  slice_push(
-      &context->functions.items[context->current_function_index].instructions,
-      (struct cbe_instruction){
-          .tag = CBE_INST_MUL, .interval_index = 0, .mul = {left, right}});
+size_t cbe_context_build_inst_mul(struct cbe_context *context,
+                                  struct cbe_typed_value left,
+                                  struct cbe_typed_value right) {
+  struct cbe_function_builder builder = cbe_context_current_builder(context);
+  return cbe_function_builder_push(&builder, cbe_build_inst_mul(left, right));
 }
 
-void cbe_context_build_inst_div(struct cbe_context *context,
-                                struct cbe_typed_value left,
-                                struct cbe_typed_value right) {
-  slice_push(
-      &context->functions.items[context->current_function_index].instructions,
-      (struct cbe_instruction){
-          .tag = CBE_INST_DIV, .interval_index = 0, .div = {left, right}});
+size_t cbe_context_build_inst_div(struct cbe_context *context,
+                                  struct cbe_typed_value left,
+                                  struct cbe_typed_value right) {
+  struct cbe_function_builder builder = cbe_context_current_builder(context);
+  return cbe_function_builder_push(&builder, cbe_build_inst_div(left, right));
 }
 
-void cbe_context_build_inst_mod(struct cbe_context *context,
-                                struct cbe_typed_value left,
-                                struct cbe_typed_value right) {
-  slice_push(
-      &context->functions.items[context->current_function_index].instructions,
-      (struct cbe_instruction){
-          .tag = CBE_INST_MOD, .interval_index = 0, .mod = {left, right}});
+size_t cbe_context_build_inst_mod(struct cbe_context *context,
+                                  struct cbe_typed_value left,
+                                  struct cbe_typed_value right) {
+  struct cbe_function_builder builder = cbe_context_current_builder(context);
+  return cbe_function_builder_push(&builder, cbe_build_inst_mod(left, right));
 }
 
-void cbe_context_build_inst_rem(struct cbe_context *context,
-                                struct cbe_typed_value left,
-                                struct cbe_typed_value right) {
-  slice_push(
-      &context->functions.items[context->current_function_index].instructions,
-      (struct cbe_instruction){
-          .tag = CBE_INST_REM, .interval_index = 0, .rem = {left, right}});
+size_t cbe_context_build_inst_rem(struct cbe_context *context,
+                                  struct cbe_typed_value left,
+                                  struct cbe_typed_value right) {
+  struct cbe_function_builder builder = cbe_context_current_builder(context);
+  return cbe_function_builder_push(&builder, cbe_build_inst_rem(left, right));
 }
 
 size_t cbe_context_build_label(struct cbe_context *context, const char *label) {
-  CBE_ASSERT(context->current_function_index != -1);
-  slice_push(&context->functions.items[context->current_function_index].labels,
-             label);
-  return context->functions.items[context->current_function_index].labels.size -
-         1;
+  struct cbe_function_builder builder = cbe_context_current_builder(context);
+  return cbe_function_builder_build_label(&builder, label);
 }
 
 static void slice_c_array(void *arr, size_t elem_size, int start, int end) {
@@ -228,23 +242,80 @@ void cbe_context_spill_at_interval(struct cbe_context *context,
   context->current_stack_location += 4;
 }
 
+/* --------------- BUILDER FUNCTIONS --------------- */
+
+struct cbe_function *cbe_function_builder_get(struct cbe_function_builder *builder) {
+  CBE_ASSERT(builder->function_index < builder->context->functions.size);
+  return &builder->context->functions.items[builder->function_index];
+}
+
+void cbe_function_builder_reserve(struct cbe_function_builder *builder,
+                                  size_t count) {
+  struct cbe_function *function = cbe_function_builder_get(builder);
+  slice_ensure_cap(&function->instructions,
+                   function->instructions.size + count);
+}
+
+size_t cbe_function_builder_append(struct cbe_function_builder *builder,
+                                   const struct cbe_instruction *instructions,
+                                   size_t count) {
+  struct cbe_function *function = cbe_function_builder_get(builder);
+  size_t first = function->instructions.size;
+  slice_append(&function->instructions, instructions, count);
+  return first;
+}
+
+size_t cbe_function_builder_push(struct cbe_function_builder *builder,
+                                 struct cbe_instruction instruction) {
+  struct cbe_function *function = cbe_function_builder_get(builder);
+  slice_push(&function->instructions, instruction);
+  return function->instructions.size - 1;
+}
+
+size_t cbe_function_builder_build_label(struct cbe_function_builder *builder,
+                                        const char *label) {
+  struct cbe_function *function = cbe_function_builder_get(builder);
+  slice_push(&function->labels, label);
+  return function->labels.size - 1;
+}
+
 /* --------------- MODULE FUNCTIONS --------------- */
 
+static void cbe_section_init(struct cbe_section *section, const char *name) {
+  section->name = name;
+  slice_init(&section->buffer);
+  section->spool = NULL;
+}
+
+static void cbe_section_free(struct cbe_section *section) {
+  slice_free(&section->buffer);
+  if (section->spool != NULL)
+    fclose(section->spool);
+}
+
 void cbe_module_init(struct cbe_module *module, struct cbe_context *context) {
   module->context = context;
-  // I think ~64MiB is enough for each one, might change up some of the sizes
-  // later though.
-  module->text = (char *)malloc(64 * 1024);
-  module->data = (char *)malloc(64 * 1024);
-  module->rodata = (char *)malloc(64 * 1024);
-  module->bss = (char *)malloc(64 * 1024);
+  module->current_function = NULL;
+  cbe_section_init(&module->text, "text");
+  cbe_section_init(&module->data, "data");
+  cbe_section_init(&module->rodata, "rodata");
+  cbe_section_init(&module->bss, "bss");
+  module->output_fd = -1;
+}
+
+void cbe_module_init_streaming(struct cbe_module *module,
+                               struct cbe_context *context, int fd) {
+  cbe_module_init(module, context);
+  module->output_fd = fd;
+  // `.text` is always the first section, so it can go straight to the output.
+  cbe_module_appendf(module, &module->text, "section .text\n");
 }
 
 void cbe_module_free(struct cbe_module *module) {
-  free((void *)module->text);
-  free((void *)module->data);
-  free((void *)module->rodata);
-  free((void *)module->bss);
+  cbe_section_free(&module->text);
+  cbe_section_free(&module->data);
+  cbe_section_free(&module->rodata);
+  cbe_section_free(&module->bss);
 }
 
 void cbe_module_generate(struct cbe_module *module) {
@@ -263,21 +334,24 @@ void cbe_module_generate(struct cbe_module *module) {
 void cbe_module_generate_global_variable(struct cbe_module *module,
                                          struct cbe_global_variable variable) {
   char *value = cbe_module_generate_typed_value(module, variable.value);
-  sprintf(variable.constant ? module->rodata : module->data,
-          "%sglobal__%ld: dw %s\n",
-          variable.constant ? module->rodata : module->data, variable.symbol_id,
-          value);
+  cbe_module_appendf(module, variable.constant ? &module->rodata : &module->data,
+                     "global__%ld: dw %s\n", variable.symbol_id, value);
   free(value);
 }
 
 void cbe_module_generate_function(struct cbe_module *module,
                                   struct cbe_function function) {
-  sprintf(module->text, "%s:\n", function.name);
+  module->current_function = &function;
+  cbe_module_appendf(module, &module->text, "%s:\n", function.name);
   for (; function.ip < function.instructions.size;) {
     struct cbe_instruction instruction =
         function.instructions.items[function.ip++];
     cbe_module_generate_instruction(module, instruction);
   }
+  module->current_function = NULL;
+
+  if (module->output_fd != -1)
+    cbe_module_flush_section(module, &module->text);
 }
 
 void cbe_module_generate_label(struct cbe_module *module);
@@ -285,19 +359,24 @@ void cbe_module_generate_label(struct cbe_module *module);
 void cbe_module_generate_instruction(struct cbe_module *module,
                                      struct cbe_instruction instruction) {
   if (cbe_instruction_expects_temporary(instruction)) {
-    struct cbe_function function =
-        module->context->functions
-            .items[module->context->current_function_index];
+    struct cbe_function *function = module->current_function;
+    CBE_ASSERT(function != NULL);
+    // `ip` has already been advanced past this instruction.
+    size_t index = function->ip - 1;
     enum cbe_register reg = cbe_context_get_register(module->context);
     struct cbe_live_interval interval = {
         .symbol = {.name = _CBE_STRINGIFY(function.ip),
                    .reg = reg,
                    .location = -1},
         .location = -1,
-        .start_point = (int)function.ip,
-        .end_point = (int)function.ip + 1};
+        .start_point = (int)index,
+        .end_point = (int)index + 1};
     slice_push(&module->context->live_intervals, interval);
     instruction.interval_index = module->context->live_intervals.size - 1;
+    // Later instructions look this up when they use the result as a
+    // temporary.
+    function->instructions.items[index].interval_index =
+        instruction.interval_index;
   }
   switch (instruction.tag) {
   case CBE_INST_ADD: {
@@ -309,8 +388,8 @@ void cbe_module_generate_instruction(struct cbe_module *module,
     char *left = cbe_module_generate_typed_value(module, instruction.add.left);
     char *right =
         cbe_module_generate_typed_value(module, instruction.add.right);
-    sprintf(module->text, "%s  mov %s, %s\n", module->text, reg, left);
-    sprintf(module->text, "%s  add %s, %s\n", module->text, reg, right);
+    cbe_module_appendf(module, &module->text, "  mov %s, %s\n", reg, left);
+    cbe_module_appendf(module, &module->text, "  add %s, %s\n", reg, right);
     free(left);
     free(right);
   } break;
@@ -327,7 +406,6 @@ char *cbe_module_generate_typed_value(struct cbe_module *module,
 
 char *cbe_module_generate_value(struct cbe_module *module,
                                 struct cbe_value value) {
-  (void)module;
   char *buffer = (char *)malloc(256); // should be enough for now
   switch (value.tag) {
   case CBE_VALUE_INTEGER:
@@ -352,6 +430,24 @@ char *cbe_module_generate_value(struct cbe_module *module,
     sprintf(buffer, "global__%ld", value.global);
     break;
 
+  case CBE_VALUE_TEMPORARY: {
+    struct cbe_function *function = module->current_function;
+    if (function == NULL)
+      CBE_PRINT_ERROR("temporaries can only be used inside of functions");
+    if (value.temporary + 1 >= function->ip)
+      CBE_PRINT_ERROR("temporary %ld is used before it is defined",
+                      value.temporary);
+    struct cbe_instruction producer =
+        function->instructions.items[value.temporary];
+    if (!cbe_instruction_expects_temporary(producer))
+      CBE_PRINT_ERROR("%s instruction doesn't produce a temporary",
+                      cbe_get_instruction_name(producer));
+    sprintf(buffer, "%s",
+            cbe_get_register_name(
+                module->context->live_intervals.items[producer.interval_index]
+                    .symbol.reg));
+  } break;
+
   default:
     CBE_PRINT_ERROR("not implemented");
   }
@@ -366,18 +462,153 @@ char *cbe_module_generate_type(struct cbe_module *module,
   return NULL;
 }
 
+void cbe_module_appendf(struct cbe_module *module, struct cbe_section *section,
+                        const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int length = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  CBE_ASSERT(length >= 0);
+
+  // One extra byte for the terminator `vsnprintf` always writes.
+  slice_ensure_cap(&section->buffer, section->buffer.size + length + 1);
+  va_start(ap, fmt);
+  vsnprintf(section->buffer.items + section->buffer.size, length + 1, fmt, ap);
+  va_end(ap);
+  section->buffer.size += length;
+
+  if (module->output_fd != -1 &&
+      section->buffer.size >= CBE_SECTION_FLUSH_THRESHOLD)
+    cbe_module_flush_section(module, section);
+}
+
+static void cbe_write_all(int fd, const char *bytes, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      CBE_PRINT_ERROR("failed to write output: %s", strerror(errno));
+    }
+    bytes += written;
+    size -= written;
+  }
+}
+
+static void cbe_writev_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      CBE_PRINT_ERROR("failed to write output: %s", strerror(errno));
+    }
+    // Skip over everything that was written, including a partial buffer.
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+// Copies the whole spool file of a section to `fd`. The bytes go from file to
+// file inside of the kernel where that is supported, otherwise through a small
+// fixed-size buffer.
+static void cbe_copy_spool(FILE *spool, int fd) {
+  int spool_fd = fileno(spool);
+  off_t size = lseek(spool_fd, 0, SEEK_END);
+  if (size < 0)
+    CBE_PRINT_ERROR("failed to seek spool file: %s", strerror(errno));
+
+  off_t offset = 0;
+#ifdef __linux__
+  while (offset < size) {
+    ssize_t copied =
+        copy_file_range(spool_fd, &offset, fd, NULL, size - offset, 0);
+    if (copied <= 0)
+      break;
+  }
+#endif
+
+  char chunk[16 * 1024];
+  while (offset < size) {
+    ssize_t count = pread(spool_fd, chunk, sizeof(chunk), offset);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      CBE_PRINT_ERROR("failed to read spool file: %s", strerror(errno));
+    }
+    if (count == 0)
+      CBE_PRINT_ERROR("spool file was truncated");
+    cbe_write_all(fd, chunk, count);
+    offset += count;
+  }
+}
+
+void cbe_module_flush_section(struct cbe_module *module,
+                              struct cbe_section *section) {
+  CBE_ASSERT(module->output_fd != -1);
+  if (section->buffer.size == 0)
+    return;
+
+  if (section == &module->text) {
+    cbe_write_all(module->output_fd, section->buffer.items,
+                  section->buffer.size);
+  } else {
+    if (section->spool == NULL && (section->spool = tmpfile()) == NULL)
+      CBE_PRINT_ERROR("failed to create spool file for .%s: %s", section->name,
+                      strerror(errno));
+    cbe_write_all(fileno(section->spool), section->buffer.items,
+                  section->buffer.size);
+  }
+  section->buffer.size = 0;
+}
+
 void cbe_module_output_to_file(struct cbe_module *module, FILE *fp) {
-  fprintf(fp, "section .text\n");
-  fprintf(fp, "%s\n", module->text);
+  CBE_ASSERT(module->output_fd == -1);
+  struct cbe_section *sections[] = {&module->text, &module->data,
+                                    &module->rodata, &module->bss};
+  for (size_t i = 0; i < CBE_ARRAY_LEN(sections); i++) {
+    fprintf(fp, "section .%s\n", sections[i]->name);
+    fwrite(sections[i]->buffer.items, 1, sections[i]->buffer.size, fp);
+    fputc('\n', fp);
+  }
+}
 
-  fprintf(fp, "section .data\n");
-  fprintf(fp, "%s\n", module->data);
+void cbe_module_finish_streaming(struct cbe_module *module) {
+  CBE_ASSERT(module->output_fd != -1);
+  char headers[3][32];
+  struct cbe_section *sections[] = {&module->data, &module->rodata,
+                                    &module->bss};
 
-  fprintf(fp, "section .rodata\n");
-  fprintf(fp, "%s\n", module->rodata);
+  // Whatever is left of `.text` goes out together with the next header.
+  struct iovec iov[3] = {
+      {module->text.buffer.items, module->text.buffer.size},
+      {"\n", 1},
+  };
+  for (size_t i = 0; i < CBE_ARRAY_LEN(sections); i++) {
+    struct cbe_section *section = sections[i];
+    int length = snprintf(headers[i], sizeof(headers[i]), "section .%s\n",
+                          section->name);
+    iov[1] = (struct iovec){"\n", 1};
+    iov[2] = (struct iovec){headers[i], (size_t)length};
+    cbe_writev_all(module->output_fd, iov, 3);
+
+    if (section->spool != NULL)
+      cbe_copy_spool(section->spool, module->output_fd);
+    iov[0] = (struct iovec){section->buffer.items, section->buffer.size};
+  }
+  iov[1] = (struct iovec){"\n", 1};
+  cbe_writev_all(module->output_fd, iov, 2);
 
-  fprintf(fp, "section .bss\n");
-  fprintf(fp, "%s\n", module->bss);
+  module->text.buffer.size = 0;
+  for (size_t i = 0; i < CBE_ARRAY_LEN(sections); i++)
+    sections[i]->buffer.size = 0;
 }
 
 /* --------------- GENERAL FUNCTIONS --------------- */
@@ -427,6 +658,46 @@ struct cbe_value cbe_build_value_global(struct cbe_context *context,
   };
 }
 
+struct cbe_value cbe_build_value_temporary(size_t index) {
+  return (struct cbe_value){.tag = CBE_VALUE_TEMPORARY, .temporary = index};
+}
+
+struct cbe_instruction cbe_build_inst_add(struct cbe_typed_value left,
+                                          struct cbe_typed_value right) {
+  return (struct cbe_instruction){
+      .tag = CBE_INST_ADD, .interval_index = 0, .add = {left, right}};
+}
+
+struct cbe_instruction cbe_build_inst_sub(struct cbe_typed_value left,
+                                          struct cbe_typed_value right) {
+  return (struct cbe_instruction){
+      .tag = CBE_INST_SUB, .interval_index = 0, .sub = {left, right}};
+}
+
+struct cbe_instruction cbe_build_inst_mul(struct cbe_typed_value left,
+                                          struct cbe_typed_value right) {
+  return (struct cbe_instruction){
+      .tag = CBE_INST_MUL, .interval_index = 0, .mul = {left, right}};
+}
+
+struct cbe_instruction cbe_build_inst_div(struct cbe_typed_value left,
+                                          struct cbe_typed_value right) {
+  return (struct cbe_instruction){
+      .tag = CBE_INST_DIV, .interval_index = 0, .div = {left, right}};
+}
+
+struct cbe_instruction cbe_build_inst_mod(struct cbe_typed_value left,
+                                          struct cbe_typed_value right) {
+  return (struct cbe_instruction){
+      .tag = CBE_INST_MOD, .interval_index = 0, .mod = {left, right}};
+}
+
+struct cbe_instruction cbe_build_inst_rem(struct cbe_typed_value left,
+                                          struct cbe_typed_value right) {
+  return (struct cbe_instruction){
+      .tag = CBE_INST_REM, .interval_index = 0, .rem = {left, right}};
+}
+
 const char *cbe_get_instruction_name(struct cbe_instruction instruction) {
   const char *names[] = {
 #define INST(a, b, ...) #b,
@@ -20,6 +20,9 @@ enum cbe_value_tag {
   CBE_VALUE_CHARACTER,
   CBE_VALUE_LOCAL,
   CBE_VALUE_GLOBAL,
+  // The result of an earlier instruction in the same function, referenced by
+  // its index in `cbe_function.instructions`.
+  CBE_VALUE_TEMPORARY,
 };
 struct cbe_value {
   enum cbe_value_tag tag;
@@ -29,6 +32,7 @@ struct cbe_value {
     const char *string;
     char character;
     cbe_symbol_id global, local;
+    size_t temporary;
   };
 };
 
@@ -98,9 +102,34 @@ struct cbe_context {
   int current_stack_location;
 };
 
+// A handle to a single function under construction. Builders store the index
+// of their function rather than a pointer, so any number of them can be alive
+// at once, and they stay valid when `cbe_context.functions` grows.
+struct cbe_function_builder {
+  struct cbe_context *context;
+  size_t function_index;
+};
+
+// Once a section grows past this many bytes in streaming mode, it gets written
+// out (`.text`) or spooled to a temporary file (every other section).
+#define CBE_SECTION_FLUSH_THRESHOLD (64 * 1024)
+
+struct cbe_section {
+  const char *name;
+  slice(char) buffer;
+  // Temporary file holding everything that has been spooled out of `buffer`
+  // so far, `NULL` if nothing has been spooled yet.
+  FILE *spool;
+};
+
 struct cbe_module {
   struct cbe_context *context;
-  char *text, *data, *rodata, *bss;
+  // The function currently being generated, `NULL` outside of
+  // `cbe_module_generate_function`.
+  struct cbe_function *current_function;
+  struct cbe_section text, data, rodata, bss;
+  // -1 unless the module was created with `cbe_module_init_streaming`.
+  int output_fd;
 };
 
 /* --------------- CONTEXT FUNCTIONS --------------- */
@@ -122,18 +151,27 @@ void cbe_context_build_global_variable(struct cbe_context *, const char *, bool,
 void cbe_context_build_function(struct cbe_context *, const char *);
 void cbe_context_finish_current_function(struct cbe_context *);
 
-void cbe_context_build_inst_add(struct cbe_context *, struct cbe_typed_value,
-                                struct cbe_typed_value);
-void cbe_context_build_inst_sub(struct cbe_context *, struct cbe_typed_value,
-                                struct cbe_typed_value);
-void cbe_context_build_inst_mul(struct cbe_context *, struct cbe_typed_value,
-                                struct cbe_typed_value);
-void cbe_context_build_inst_div(struct cbe_context *, struct cbe_typed_value,
-                                struct cbe_typed_value);
-void cbe_context_build_inst_mod(struct cbe_context *, struct cbe_typed_value,
-                                struct cbe_typed_value);
-void cbe_context_build_inst_rem(struct cbe_context *, struct cbe_typed_value,
-                                struct cbe_typed_value);
+// Creates a new function and returns a builder for it. Unlike
+// `cbe_context_build_function`, this doesn't touch `current_function_index`,
+// so several functions can be built at the same time.
+struct cbe_function_builder
+cbe_context_create_function_builder(struct cbe_context *, const char *);
+
+// All of the `cbe_context_build_inst_*` functions append to the current
+// function and return the index of the new instruction, which can be used with
+// `cbe_build_value_temporary`.
+size_t cbe_context_build_inst_add(struct cbe_context *, struct cbe_typed_value,
+                                  struct cbe_typed_value);
+size_t cbe_context_build_inst_sub(struct cbe_context *, struct cbe_typed_value,
+                                  struct cbe_typed_value);
+size_t cbe_context_build_inst_mul(struct cbe_context *, struct cbe_typed_value,
+                                  struct cbe_typed_value);
+size_t cbe_context_build_inst_div(struct cbe_context *, struct cbe_typed_value,
+                                  struct cbe_typed_value);
+size_t cbe_context_build_inst_mod(struct cbe_context *, struct cbe_typed_value,
+                                  struct cbe_typed_value);
+size_t cbe_context_build_inst_rem(struct cbe_context *, struct cbe_typed_value,
+                                  struct cbe_typed_value);
 
 size_t cbe_context_build_label(struct cbe_context *, const char *);
 
@@ -146,9 +184,35 @@ void cbe_context_expire_old_intervals(struct cbe_context *,
 void cbe_context_spill_at_interval(struct cbe_context *,
                                    struct cbe_live_interval *);
 
+/* --------------- BUILDER FUNCTIONS --------------- */
+
+struct cbe_function *cbe_function_builder_get(struct cbe_function_builder *);
+
+// Makes sure at least `count` more instructions can be appended without
+// reallocating.
+void cbe_function_builder_reserve(struct cbe_function_builder *, size_t);
+
+// Appends `count` instructions in one go and returns the index of the first
+// one. Temporaries inside of `instructions` refer to absolute indices, so a
+// caller lowering a whole expression tree can use the index of the first
+// instruction as the base for them.
+size_t cbe_function_builder_append(struct cbe_function_builder *,
+                                   const struct cbe_instruction *, size_t);
+size_t cbe_function_builder_push(struct cbe_function_builder *,
+                                 struct cbe_instruction);
+
+size_t cbe_function_builder_build_label(struct cbe_function_builder *,
+                                        const char *);
+
 /* --------------- MODULE FUNCTIONS --------------- */
 
 void cbe_module_init(struct cbe_module *, struct cbe_context *);
+// Streaming modules write `.text` to `fd` as soon as each function has been
+// generated, and spool the remaining sections to temporary files once they
+// get large, so memory usage doesn't grow with the size of the output. Call
+// `cbe_module_finish_streaming` after `cbe_module_generate` to write out the
+// rest.
+void cbe_module_init_streaming(struct cbe_module *, struct cbe_context *, int);
 void cbe_module_free(struct cbe_module *);
 
 void cbe_module_generate(struct cbe_module *);
@@ -167,7 +231,13 @@ char *cbe_module_generate_typed_value(struct cbe_module *,
 char *cbe_module_generate_value(struct cbe_module *, struct cbe_value);
 char *cbe_module_generate_type(struct cbe_module *, struct cbe_type);
 
+void cbe_module_appendf(struct cbe_module *, struct cbe_section *,
+                        const char *, ...)
+    __attribute__((format(printf, 3, 4)));
+void cbe_module_flush_section(struct cbe_module *, struct cbe_section *);
+
 void cbe_module_output_to_file(struct cbe_module *, FILE *);
+void cbe_module_finish_streaming(struct cbe_module *);
 
 /* --------------- GENERAL FUNCTIONS --------------- */
 
@@ -182,6 +252,20 @@ struct cbe_value cbe_build_value_string(const char *);
 struct cbe_value cbe_build_value_character(char);
 struct cbe_value cbe_build_value_local(struct cbe_context *, const char *);
 struct cbe_value cbe_build_value_global(struct cbe_context *, const char *);
+struct cbe_value cbe_build_value_temporary(size_t);
+
+struct cbe_instruction cbe_build_inst_add(struct cbe_typed_value,
+                                          struct cbe_typed_value);
+struct cbe_instruction cbe_build_inst_sub(struct cbe_typed_value,
+                                          struct cbe_typed_value);
+struct cbe_instruction cbe_build_inst_mul(struct cbe_typed_value,
+                                          struct cbe_typed_value);
+struct cbe_instruction cbe_build_inst_div(struct cbe_typed_value,
+                                          struct cbe_typed_value);
+struct cbe_instruction cbe_build_inst_mod(struct cbe_typed_value,
+                                          struct cbe_typed_value);
+struct cbe_instruction cbe_build_inst_rem(struct cbe_typed_value,
+                                          struct cbe_typed_value);
 
 const char *cbe_get_instruction_name(struct cbe_instruction);
 bool cbe_instruction_expects_temporary(struct cbe_instruction);
@@ -44,7 +44,8 @@
     if ((s)->size >= (s)->cap) {                                               \
       (s)->cap *= 2;                                                           \
       (s)->items = (__typeof__(*(s)->items) *)realloc(                         \
-          (__typeof__(*(s)->items) *)(s)->items, sizeof(*(s)->items) * 256);   \
+          (__typeof__(*(s)->items) *)(s)->items,                               \
+          sizeof(*(s)->items) * (s)->cap);                                     \
     }                                                                          \
     (s)->items[(s)->size++] = (__VA_ARGS__);                                   \
   } while (0)
@@ -66,9 +67,29 @@
     (s)->size = size;                                                          \
   } while (0)
 
+// Grows the backing storage so that at least `c` items fit without another
+// reallocation. Never shrinks the slice.
 #define slice_ensure_cap(s, c)                                                 \
   do {                                                                         \
-    (s)->cap = (c);                                                            \
+    if ((size_t)(c) > (s)->cap) {                                              \
+      (s)->cap = (c);                                                          \
+      (s)->items = (__typeof__(*(s)->items) *)realloc(                         \
+          (__typeof__(*(s)->items) *)(s)->items,                               \
+          sizeof(*(s)->items) * (s)->cap);                                     \
+    }                                                                          \
+  } while (0)
+
+// Copies `count` items from `src` to the end of the slice, growing it at most
+// once.
+#define slice_append(s, src, count)                                            \
+  do {                                                                         \
+    size_t needed = (s)->size + (count);                                       \
+    if (needed > (s)->cap) {                                                   \
+      size_t cap = (s)->cap * 2;                                               \
+      slice_ensure_cap(s, cap > needed ? cap : needed);                        \
+    }                                                                          \
+    memcpy((s)->items + (s)->size, (src), sizeof(*(s)->items) * (count));      \
+    (s)->size = needed;                                                        \
   } while (0)
 
 #endif // CBE_TYPES_H
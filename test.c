@@ -31,7 +31,7 @@ int main(void) {
 
   cbe_context_build_label(&context, "entry");
 
-  cbe_context_build_inst_add(
+  size_t sum = cbe_context_build_inst_add(
       &context,
       cbe_build_typed_value(cbe_build_type_int(32),
                             cbe_build_value_integer(50)),
@@ -40,6 +40,20 @@ int main(void) {
 
   cbe_context_finish_current_function(&context);
 
+  {
+    struct cbe_function_builder builder = {&context, 0};
+    struct cbe_instruction instructions[] = {
+        cbe_build_inst_add(
+            cbe_build_typed_value(cbe_build_type_int(32),
+                                  cbe_build_value_temporary(sum)),
+            cbe_build_typed_value(cbe_build_type_int(32),
+                                  cbe_build_value_integer(25))),
+    };
+    cbe_function_builder_reserve(&builder, CBE_ARRAY_LEN(instructions));
+    cbe_function_builder_append(&builder, instructions,
+                                CBE_ARRAY_LEN(instructions));
+  }
+
   struct cbe_module module;
   cbe_module_init(&module, &context);
 